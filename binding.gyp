@@ -8,7 +8,7 @@
         'conditions': [
           ['OS=="mac"', {
             'libraries': [
-                '<!@(PKG_CONFIG_PATH=/usr/local/Library/ENV/pkgconfig/10.8 pkg-config --libs glib-2.0 vips exiv2)',
+                '<!@(PKG_CONFIG_PATH=/usr/local/Library/ENV/pkgconfig/10.8 pkg-config --libs glib-2.0 "vips >= 7.32" exiv2)',
             ],
             'include_dirs': [
               '/usr/local/include/glib-2.0',
@@ -18,7 +18,7 @@
             ]
           }, {
             'libraries': [
-                '<!@(PKG_CONFIG_PATH="/usr/local/lib/pkgconfig" pkg-config --libs glib-2.0 vips exiv2)'
+                '<!@(PKG_CONFIG_PATH="/usr/local/lib/pkgconfig" pkg-config --libs glib-2.0 "vips >= 7.32" exiv2)'
             ],
             'include_dirs': [
                 '/usr/include/glib-2.0',
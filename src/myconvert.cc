@@ -1,7 +1,7 @@
 // Copyright Erly Inc 2011, All Rights Reserved
 // Author: Walt Lin
 //
-// To compile: g++ -o myconvert  src/myconvert.cc src/transform.cc   `pkg-config --cflags --libs exiv2 vips-7.26`
+// To compile: g++ -o myconvert  src/myconvert.cc src/transform.cc   `pkg-config --cflags --libs exiv2 'vips >= 7.32'`
 
 #include <assert.h>
 #include <errno.h>
@@ -44,7 +44,7 @@ int main(int argc, char **argv) {
 
     std::string err;
     if (DoTransform(width, height, crop_to_size, 0, auto_orient,
-		    argv[1], argv[2], NULL, NULL, &err)) {
+		    argv[1], argv[2], NULL, NULL, kHashNone, NULL, &err)) {
       printf("resize failed: %s\n", err.c_str());
       return 1;
     }
@@ -63,7 +63,7 @@ int main(int argc, char **argv) {
 
     std::string err;
     if (DoTransform(-1, -1, false, degrees, false,
-		    argv[1], argv[2], NULL, NULL, &err)) {
+		    argv[1], argv[2], NULL, NULL, kHashNone, NULL, &err)) {
       printf("rotate failed: %s\n", err.c_str());
       return 1;
     }
@@ -75,7 +75,7 @@ int main(int argc, char **argv) {
 
     std::string err;
     if (DoTransform(-1, -1, false, 0, true /* auto-orient */,
-                    argv[1], argv[2], NULL, NULL, &err)) {
+                    argv[1], argv[2], NULL, NULL, kHashNone, NULL, &err)) {
       printf("autorotate failed: %s\n", err.c_str());
       return 1;
     }
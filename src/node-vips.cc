@@ -6,11 +6,23 @@
 // Javascript functions exported:
 //
 //   resize(input_path, output_path, new_x, new_y, crop_to_size,
-//          auto_orient, callback<Error, metadata>)
+//          auto_orient, [hash_type], callback<Error, metadata>)
 //
 //   rotate(input_path, output_path, degrees, callback<Error, metadata>)
 //
-// 'metadata' is an object with 'width' and 'height' properties.
+//   hash(input_path_or_buffer, [hash_type], callback<Error, hash>)
+//
+//   setConcurrency(threads)   vips threads, shared by all jobs; 0 is auto
+//   setCacheMax(max_ops)      size of the vips operation cache
+//   setIOMode(mmap_input, atomic_output, fsync_output)
+//   setCoalesce(enabled)      share one job among identical transforms
+//   transformStats()          { queued: jobs queued, coalesced: calls
+//                             that shared another call's job, threads:
+//                             current vips threads per image }
+//
+// 'metadata' is an object with 'width' and 'height' properties, and a
+// 'hash' property if 'hash_type' was given.  'hash_type' is "dhash" (the
+// default for hash()) or "phash"; hashes are 16 hex digit strings.
 // The functions will reject images they cannot open.
 
 #include <node.h>
@@ -18,7 +30,11 @@
 #include <node_version.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
 #include <string>
+#include <vector>
 
 
 #include "transform.h"
@@ -51,6 +67,20 @@ namespace {
                   String::New("Argument " #I " must be a boolean")));   \
   bool VAR = args[I]->BooleanValue()
 
+// Return the kHash constant named by 'v', or -1 if it names none.
+int ParseHashType(Handle<Value> v) {
+  String::Utf8Value name(v);
+  if (strcmp(*name, "dhash") == 0) return kHashDHash;
+  if (strcmp(*name, "phash") == 0) return kHashPHash;
+  return -1;
+}
+
+Local<String> HashToString(uint64_t hash) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+  return String::New(buf);
+}
+
 // Data needed for a call to Transform.
 // If cols or rows is <= 0, no resizing is done.
 // rotate_degrees must be one of 0, 90, 180, or 270.
@@ -62,28 +92,90 @@ struct TransformCall {
   bool auto_orient;
   int  new_width;
   int  new_height;
+  int  hash_type;         // one of the kHash constants
+  uint64_t hash;
   std::string src_path;
   std::string dst_path;
   std::string err_msg;
   Persistent<Function> cb;
+  std::string key;        // set if other calls may be coalesced with this
+  std::vector<Persistent<Function> > waiters;  // callbacks of those calls
+  bool src_changed;       // source was modified while the job ran
 
   TransformCall() :
     cols(-1), rows(-1), crop_to_size(false), rotate_degrees(0),
-    auto_orient(false), new_width(0), new_height(0) {}
+    auto_orient(false), new_width(0), new_height(0),
+    hash_type(kHashNone), hash(0), src_changed(false) {}
 };
 
+// Return a string identifying the current contents of the file at 'path',
+// or "" if it can't be stat'ed.
+std::string SourceIdentity(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return "";
+  }
+#ifdef __APPLE__
+  const struct timespec& mtime = st.st_mtimespec;
+#else
+  const struct timespec& mtime = st.st_mtim;
+#endif
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%lu:%lu:%lld:%ld.%09ld",
+           static_cast<unsigned long>(st.st_dev),
+           static_cast<unsigned long>(st.st_ino),
+           static_cast<long long>(st.st_size),
+           static_cast<long>(mtime.tv_sec),
+           static_cast<long>(mtime.tv_nsec));
+  return buf;
+}
+
 void EIO_Transform(uv_work_t *req) {
   TransformCall* t = static_cast<TransformCall*>(req->data);
+  // Calls may have been coalesced with this one at any time until it
+  // finishes, so note if the source changed under it; see TransformDone.
+  std::string before;
+  if (!t->key.empty()) {
+    before = SourceIdentity(t->src_path);
+  }
   DoTransform(t->cols, t->rows, t->crop_to_size, t->rotate_degrees,
               t->auto_orient, t->src_path, t->dst_path,
-              &t->new_width, &t->new_height, &t->err_msg);
+              &t->new_width, &t->new_height, t->hash_type, &t->hash,
+              &t->err_msg);
+  if (!t->key.empty()) {
+    t->src_changed = SourceIdentity(t->src_path) != before;
+  }
 }
 
-// Done function that invokes a callback.
-void TransformDone(uv_work_t *req, int status) {
-  HandleScope scope;
-  TransformCall *c = static_cast<TransformCall*>(req->data);
+// Whether identical transforms share a single job, see QueueTransform.
+bool coalesce = false;
+
+// Coalescable transforms that are queued or running, by key.
+std::map<std::string, TransformCall*> in_flight;
+
+// Totals reported by transformStats().
+double jobs_queued = 0;
+double calls_coalesced = 0;
+
+// Return the key identifying the work done by 'c': the source path, the
+// normalized transform parameters, and the destination.  The source file
+// is not touched here, to keep filesystem access off the event loop; the
+// job checks that it did not change instead.
+std::string CoalesceKey(const TransformCall& c) {
+  bool resize = c.cols > 0 && c.rows > 0;
+  char params[96];
+  snprintf(params, sizeof(params), "%d:%d:%d:%d:%d:%d",
+           resize ? c.cols : -1, resize ? c.rows : -1,
+           resize && c.crop_to_size, c.rotate_degrees, c.auto_orient,
+           c.hash_type);
+  std::string key(c.src_path);
+  key.append("|").append(params);
+  key.append("|").append(c.dst_path);
+  return key;
+}
 
+// Invoke 'cb' with the result of 'c'.
+void CallTransformCallback(TransformCall* c, Persistent<Function> cb) {
   Local<Value> argv[2];
   if (!c->err_msg.empty()) {  // req->result is NOT set correctly
     // Set up an error object.
@@ -93,22 +185,88 @@ void TransformDone(uv_work_t *req, int status) {
     Local<Object> metadata = Object::New();
     metadata->Set(String::New("width"), Integer::New(c->new_width));
     metadata->Set(String::New("height"), Integer::New(c->new_height));
+    if (c->hash_type != kHashNone) {
+      metadata->Set(String::New("hash"), HashToString(c->hash));
+    }
     argv[0] = Local<Value>::New(Null());
     argv[1] = metadata;
   }
 
   TryCatch try_catch;
-  c->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+  cb->Call(Context::GetCurrent()->Global(), 2, argv);
   if (try_catch.HasCaught()) {
     FatalException(try_catch);
   }
+}
+
+void QueueTransform(TransformCall* c);
+
+// Done function that invokes a callback, and those of any calls that were
+// coalesced with it.  If the source changed while the job ran, the result
+// may predate some of those calls, so they are run again instead.
+void TransformDone(uv_work_t *req, int status) {
+  HandleScope scope;
+  TransformCall *c = static_cast<TransformCall*>(req->data);
+
+  // Stop coalescing first, so calls made from the callbacks start afresh.
+  if (!c->key.empty()) {
+    in_flight.erase(c->key);
+  }
 
+  if (c->src_changed && !c->waiters.empty()) {
+    TransformCall* retry = new TransformCall;
+    retry->cols = c->cols;
+    retry->rows = c->rows;
+    retry->crop_to_size = c->crop_to_size;
+    retry->rotate_degrees = c->rotate_degrees;
+    retry->auto_orient = c->auto_orient;
+    retry->hash_type = c->hash_type;
+    retry->src_path = c->src_path;
+    retry->dst_path = c->dst_path;
+    retry->cb = c->waiters[0];
+    retry->waiters.assign(c->waiters.begin() + 1, c->waiters.end());
+    c->waiters.clear();
+    QueueTransform(retry);
+  }
+
+  CallTransformCallback(c, c->cb);
   c->cb.Dispose();
+  for (size_t i = 0; i < c->waiters.size(); i++) {
+    CallTransformCallback(c, c->waiters[i]);
+    c->waiters[i].Dispose();
+  }
+
   delete c;
   delete req;
 }
 
-// ResizeAsync(input_path, output_path, new_x, new_y, auto_orient, callback)
+// Queue 'c' to run on the thread pool, taking ownership of it.  If
+// coalescing is on and an identical transform is already queued or
+// running, attach the callback of 'c' to that one instead.
+void QueueTransform(TransformCall* c) {
+  if (coalesce) {
+    c->key = CoalesceKey(*c);
+    std::map<std::string, TransformCall*>::iterator it =
+        in_flight.find(c->key);
+    if (it != in_flight.end()) {
+      std::vector<Persistent<Function> >& waiters = it->second->waiters;
+      waiters.push_back(c->cb);
+      waiters.insert(waiters.end(), c->waiters.begin(), c->waiters.end());
+      calls_coalesced += 1 + c->waiters.size();
+      delete c;
+      return;
+    }
+    in_flight[c->key] = c;
+  }
+
+  jobs_queued++;
+  uv_work_t *req = new uv_work_t;
+  req->data = c;
+  uv_queue_work(uv_default_loop(), req, EIO_Transform, (uv_after_work_cb)TransformDone);
+}
+
+// ResizeAsync(input_path, output_path, new_x, new_y, crop_to_size,
+//             auto_orient, [hash_type], callback)
 Handle<Value> ResizeAsync(const Arguments& args) {
   HandleScope scope;
   REQ_STR_ARG(0, input_path);
@@ -117,9 +275,24 @@ Handle<Value> ResizeAsync(const Arguments& args) {
   REQ_NUM_ARG(3, new_y_px);
   REQ_BOOL_ARG(4, crop_to_size);
   REQ_BOOL_ARG(5, auto_orient);
-  REQ_FUN_ARG(6, cb);
+  int hash_type = kHashNone;
+  Local<Function> cb;
+  if (args.Length() > 7) {
+    REQ_STR_ARG(6, hash_name);
+    REQ_FUN_ARG(7, hash_cb);
+    hash_type = ParseHashType(hash_name);
+    if (hash_type < 0) {
+      return ThrowException(Exception::TypeError(
+                    String::New("Argument 6 must be \"dhash\" or \"phash\"")));
+    }
+    cb = hash_cb;
+  } else {
+    REQ_FUN_ARG(6, resize_cb);
+    cb = resize_cb;
+  }
 
   TransformCall *c = new TransformCall;
+  c->hash_type = hash_type;
   c->cols = new_x_px;
   c->rows = new_y_px;
   c->crop_to_size = crop_to_size;
@@ -128,9 +301,7 @@ Handle<Value> ResizeAsync(const Arguments& args) {
   c->dst_path = *String::Utf8Value(output_path);
   c->cb = Persistent<Function>::New(cb);
 
-  uv_work_t *req = new uv_work_t;
-  req->data = c;
-  uv_queue_work(uv_default_loop(), req, EIO_Transform, (uv_after_work_cb)TransformDone);
+  QueueTransform(c);
   return Undefined();
 }
 
@@ -148,9 +319,149 @@ Handle<Value> RotateAsync(const Arguments& args) {
   c->dst_path = *String::Utf8Value(output_path);
   c->cb = Persistent<Function>::New(cb);
 
+  QueueTransform(c);
+  return Undefined();
+}
+
+// SetConcurrency(threads)
+Handle<Value> SetConcurrencySync(const Arguments& args) {
+  HandleScope scope;
+  REQ_NUM_ARG(0, threads);
+  if (SetConcurrency(threads) < 0) {
+    return ThrowException(Exception::RangeError(
+                  String::New("Argument 0 must not be negative")));
+  }
+  return Undefined();
+}
+
+// SetCacheMax(max_ops)
+Handle<Value> SetCacheMaxSync(const Arguments& args) {
+  HandleScope scope;
+  REQ_NUM_ARG(0, max_ops);
+  if (SetCacheMax(max_ops) < 0) {
+    return ThrowException(Exception::RangeError(
+                  String::New("Argument 0 must not be negative")));
+  }
+  return Undefined();
+}
+
+// SetIOMode(mmap_input, atomic_output, fsync_output)
+Handle<Value> SetIOModeSync(const Arguments& args) {
+  HandleScope scope;
+  REQ_BOOL_ARG(0, mmap_input);
+  REQ_BOOL_ARG(1, atomic_output);
+  REQ_BOOL_ARG(2, fsync_output);
+  SetIOMode((mmap_input ? kIOMmapInput : 0) |
+            (atomic_output ? kIOAtomicOutput : 0) |
+            (fsync_output ? kIOFsyncOutput : 0));
+  return Undefined();
+}
+
+// SetCoalesce(enabled)
+Handle<Value> SetCoalesceSync(const Arguments& args) {
+  HandleScope scope;
+  REQ_BOOL_ARG(0, enabled);
+  coalesce = enabled;
+  return Undefined();
+}
+
+// TransformStats()
+Handle<Value> TransformStatsSync(const Arguments& args) {
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+  stats->Set(String::New("queued"), Number::New(jobs_queued));
+  stats->Set(String::New("coalesced"), Number::New(calls_coalesced));
+  stats->Set(String::New("threads"), Integer::New(GetConcurrency()));
+  return scope.Close(stats);
+}
+
+// Data needed for a call to PerceptualHash.  If 'data' is set the image
+// is hashed from the 'len' bytes there, which belong to 'buffer';
+// otherwise it is hashed from 'src_path'.
+struct HashCall {
+  int hash_type;
+  uint64_t hash;
+  std::string src_path;
+  const char* data;
+  size_t len;
+  Persistent<Object> buffer;  // keeps 'data' from being collected
+  std::string err_msg;
+  Persistent<Function> cb;
+
+  HashCall() : hash_type(kHashDHash), hash(0), data(NULL), len(0) {}
+};
+
+void EIO_Hash(uv_work_t *req) {
+  HashCall* h = static_cast<HashCall*>(req->data);
+  PerceptualHash(h->hash_type, h->src_path, h->data, h->len,
+                 &h->hash, &h->err_msg);
+}
+
+void HashDone(uv_work_t *req, int status) {
+  HandleScope scope;
+  HashCall *h = static_cast<HashCall*>(req->data);
+
+  Local<Value> argv[2];
+  if (!h->err_msg.empty()) {
+    argv[0] = String::New(h->err_msg.data(), h->err_msg.size());
+    argv[1] = Local<Value>::New(Null());
+  } else {
+    argv[0] = Local<Value>::New(Null());
+    argv[1] = HashToString(h->hash);
+  }
+
+  TryCatch try_catch;
+  h->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+  if (try_catch.HasCaught()) {
+    FatalException(try_catch);
+  }
+
+  h->cb.Dispose();
+  if (!h->buffer.IsEmpty()) {
+    h->buffer.Dispose();
+  }
+  delete h;
+  delete req;
+}
+
+// HashAsync(input_path_or_buffer, [hash_type], callback)
+Handle<Value> HashAsync(const Arguments& args) {
+  HandleScope scope;
+  int hash_type = kHashDHash;
+  Local<Function> cb;
+  if (args.Length() > 2) {
+    REQ_STR_ARG(1, hash_name);
+    REQ_FUN_ARG(2, hash_cb);
+    hash_type = ParseHashType(hash_name);
+    if (hash_type < 0) {
+      return ThrowException(Exception::TypeError(
+                    String::New("Argument 1 must be \"dhash\" or \"phash\"")));
+    }
+    cb = hash_cb;
+  } else {
+    REQ_FUN_ARG(1, path_cb);
+    cb = path_cb;
+  }
+
+  HashCall *h = new HashCall;
+  if (args.Length() > 0 && Buffer::HasInstance(args[0])) {
+    Local<Object> buffer = args[0]->ToObject();
+    h->buffer = Persistent<Object>::New(buffer);
+    h->data = Buffer::Data(buffer);
+    h->len = Buffer::Length(buffer);
+  } else if (args.Length() > 0 && args[0]->IsString()) {
+    h->src_path = *String::Utf8Value(args[0]);
+  } else {
+    delete h;
+    return ThrowException(Exception::TypeError(
+                  String::New("Argument 0 must be a string or a buffer")));
+  }
+  h->hash_type = hash_type;
+  h->cb = Persistent<Function>::New(cb);
+
   uv_work_t *req = new uv_work_t;
-  req->data = c;
-  uv_queue_work(uv_default_loop(), req, EIO_Transform, (uv_after_work_cb)TransformDone);
+  req->data = h;
+  uv_queue_work(uv_default_loop(), req, EIO_Hash, (uv_after_work_cb)HashDone);
   return Undefined();
 }
 
@@ -237,7 +548,13 @@ extern "C" void init(Handle<Object> target) {
   HandleScope scope;
   NODE_SET_METHOD(target, "resize", ResizeAsync);
   NODE_SET_METHOD(target, "rotate", RotateAsync);
+  NODE_SET_METHOD(target, "hash", HashAsync);
   NODE_SET_METHOD(target, "createPNGPixel", PngPixelAsync);
+  NODE_SET_METHOD(target, "setConcurrency", SetConcurrencySync);
+  NODE_SET_METHOD(target, "setCacheMax", SetCacheMaxSync);
+  NODE_SET_METHOD(target, "setIOMode", SetIOModeSync);
+  NODE_SET_METHOD(target, "setCoalesce", SetCoalesceSync);
+  NODE_SET_METHOD(target, "transformStats", TransformStatsSync);
 };
 
 NODE_MODULE(vips, init)
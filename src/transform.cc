@@ -22,17 +22,25 @@
 //  We could potentially try to fix these up by stripping the other tags but
 //  that's not necessary to get them to display correctly in the browser.
 //
+// Requires vips 7.32 or later for the VipsForeign jpeg loaders.
+//
 // To compile a test program on linux that uses this library:
-//  g++ -o myconvert  src/myconvert.cc src/transform.cc   `pkg-config --cflags --libs vips-7.26`  `pkg-config --cflags --libs exiv2`
+//  g++ -o myconvert  src/myconvert.cc src/transform.cc   `pkg-config --cflags --libs 'vips >= 7.32'`  `pkg-config --cflags --libs exiv2`
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <algorithm>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -49,6 +57,28 @@ static const char kJpegCompressionFactor[] = ":92";
 
 static const char kOrientationTag[] = "Exif.Image.Orientation";
 
+// Images up to this many pixels are processed with a single vips thread
+// in automatic concurrency mode; above it, one thread is added for every
+// kPixelsPerThread pixels more, up to the running jobs' share of the cores.
+static const int64_t kSmallImagePixels = 2 * 1000 * 1000;
+static const int64_t kPixelsPerThread = 4 * 1000 * 1000;
+
+// Threads as set by SetConcurrency, or kAutoConcurrency.
+static volatile gint concurrency_setting = kAutoConcurrency;
+
+// Threads wanted by each running transform in automatic concurrency mode,
+// see ConcurrencyDemand.
+static pthread_mutex_t demands_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::multiset<int> demands;
+
+// kIO flags as set by SetIOMode.
+static volatile gint io_mode = 0;
+
+// Mode for files created by TempOutput: what open() would give with the
+// process umask, read once by InitTransform since umask() can only be
+// read by setting it.
+static mode_t output_mode = 0644;
+
 string SimpleItoa(int x) {
   char buf[16];
   snprintf(buf, sizeof(buf), "%d", x);
@@ -75,6 +105,184 @@ class ImageFreer {
   std::vector<VipsImage*> v_;
 };
 
+// Read-only memory mapping of a whole file, unmapped when this object goes
+// out of scope unless handed over to an image with UnmapWhenClosed.
+class MappedFile {
+ public:
+  MappedFile() : data_(NULL), size_(0), owned_(true) {}
+
+  ~MappedFile() {
+    if (data_ != NULL && owned_) {
+      munmap(data_, size_);
+    }
+  }
+
+  // Return 0 on success, < 0 if an error and fill in 'err'.
+  int Map(const string& path, string* err) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      err->assign("could not open file: ");
+      err->append(strerror(errno));
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      err->assign("could not stat file");
+      close(fd);
+      return -1;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      err->assign("could not map file: ");
+      err->append(strerror(errno));
+      return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    data_ = p;
+    size_ = st.st_size;
+    return 0;
+  }
+
+  // Unmap when 'image' is closed instead.  Use this for an image that
+  // reads from the mapping, so that it stays valid for as long as anything
+  // holds a reference to the image.
+  void UnmapWhenClosed(VipsImage* image) {
+    std::pair<void*, size_t>* region =
+        new std::pair<void*, size_t>(data_, size_);
+    g_signal_connect(image, "postclose", G_CALLBACK(Unmap), region);
+    owned_ = false;
+  }
+
+  void* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  static void Unmap(VipsImage* image, std::pair<void*, size_t>* region) {
+    munmap(region->first, region->second);
+    delete region;
+  }
+
+  void* data_;
+  size_t size_;
+  bool owned_;
+};
+
+// A temporary file next to some destination path that can be renamed over
+// it.  The file is removed when this object goes out of scope unless
+// Commit succeeded.
+//
+// The name keeps the destination's extension since vips picks the output
+// format from it; for the same reason we can't use O_TMPFILE, as the vips
+// writers open their output by name.
+class TempOutput {
+ public:
+  TempOutput() : committed_(false) {}
+
+  ~TempOutput() {
+    if (!path_.empty() && !committed_) {
+      unlink(path_.c_str());
+    }
+  }
+
+  // Create the file.  Return 0 on success, < 0 if an error and fill in
+  // 'err'.
+  int Create(const string& dst_path, string* err) {
+    dst_path_ = dst_path;
+    size_t slash = dst_path.rfind('/');
+    string dir = slash == string::npos ? "" : dst_path.substr(0, slash + 1);
+    string base = dst_path.substr(dir.size());
+    size_t dot = base.rfind('.');
+    string ext = dot == string::npos ? "" : base.substr(dot);
+
+    string tmpl = dir + "." + base + ".XXXXXX" + ext;
+    std::vector<char> buf(tmpl.begin(), tmpl.end());
+    buf.push_back('\0');
+    int fd = mkstemps(&buf[0], ext.size());
+    if (fd < 0) {
+      err->assign("could not create temp output: ");
+      err->append(strerror(errno));
+      return -1;
+    }
+    // mkstemps creates the file 0600; give it the usual mode for output.
+    fchmod(fd, output_mode);
+    close(fd);
+    path_.assign(&buf[0]);
+    return 0;
+  }
+
+  // Rename the file to the destination, syncing first and after if 'sync'.
+  // Return 0 on success, < 0 if an error and fill in 'err'.
+  int Commit(bool sync, string* err) {
+    if (sync && SyncPath(path_) < 0) {
+      err->assign("could not fsync output");
+      return -1;
+    }
+    if (rename(path_.c_str(), dst_path_.c_str()) < 0) {
+      err->assign("could not rename output: ");
+      err->append(strerror(errno));
+      return -1;
+    }
+    committed_ = true;
+    if (sync) {
+      size_t slash = dst_path_.rfind('/');
+      string dir = slash == string::npos ? "." : dst_path_.substr(0, slash + 1);
+      if (SyncPath(dir) < 0) {
+        err->assign("could not fsync output directory");
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  const string& path() const { return path_; }
+
+ private:
+  static int SyncPath(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return -1;
+    }
+    int r = fsync(fd);
+    close(fd);
+    return r;
+  }
+
+  string path_;
+  string dst_path_;
+  bool committed_;
+};
+
+// Load a JPEG from 'path', or from the 'len' bytes at 'buf' if it is
+// non-NULL, shrinking it by 'shrink' while decoding.  Unlike vips_jpegload
+// this bypasses the vips operation cache, which would otherwise hold on to
+// the image, and so to pointers into 'buf', after the caller is done with
+// it.  Return NULL on error.
+static VipsImage* LoadJpegUncached(const string& path, void* buf, size_t len,
+                                   int shrink) {
+  VipsOperation* op =
+      vips_operation_new(buf != NULL ? "jpegload_buffer" : "jpegload");
+  if (op == NULL) {
+    return NULL;
+  }
+  if (buf != NULL) {
+    VipsBlob* blob = vips_blob_new(NULL, buf, len);
+    g_object_set(op, "buffer", blob, NULL);
+    vips_area_unref(VIPS_AREA(blob));
+  } else {
+    g_object_set(op, "filename", path.c_str(), NULL);
+  }
+  g_object_set(op, "shrink", shrink, NULL);
+
+  VipsImage* out = NULL;
+  if (vips_object_build(VIPS_OBJECT(op)) == 0) {
+    g_object_get(op, "out", &out, NULL);
+  }
+  vips_object_unref_outputs(VIPS_OBJECT(op));
+  g_object_unref(op);
+  return out;
+}
+
 // Set an error message from the vips buffer, and clear it.
 static void SetFromVipsError(string* out, const char* msg) {
   out->assign(msg);
@@ -84,11 +292,17 @@ static void SetFromVipsError(string* out, const char* msg) {
 }
 
 // Read EXIF data for image in 'path' and return the rotation needed to turn
-// it right side up.  Return < 0 upon error, and fill in 'err'.
-static int GetEXIFRotationNeeded(const string& path, string* err) {
+// it right side up.  If 'data' is non-NULL it holds the contents of 'path'
+// and is parsed instead of reading the file.  Return < 0 upon error, and
+// fill in 'err'.
+static int GetEXIFRotationNeeded(const string& path, const void* data,
+                                 size_t size, string* err) {
   int orientation = 0;
   try {
-    Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(path);
+    Exiv2::Image::AutoPtr image = data == NULL ?
+        Exiv2::ImageFactory::open(path) :
+        Exiv2::ImageFactory::open(static_cast<const Exiv2::byte*>(data),
+                                  size);
     assert(image.get() != 0);
     image->readMetadata();
     Exiv2::ExifData &ed = image->exifData();
@@ -157,6 +371,167 @@ static int CalculateShrink(int width, int height,
   return shrink;
 }
 
+// Side of the square thumbnail the kHashPHash DCT is taken over, and of
+// the block of lowest frequencies that make up the hash.
+static const int kPHashSize = 32;
+static const int kPHashLowFreq = 8;
+
+// Difference hash of a 9x8 grayscale image: one bit per pixel pair, set
+// if the left pixel is darker than its right neighbour.
+static uint64_t DHash(const std::vector<double>& g) {
+  uint64_t hash = 0;
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) {
+      hash = (hash << 1) | (g[y * 9 + x] < g[y * 9 + x + 1]);
+    }
+  }
+  return hash;
+}
+
+// DCT hash of a kPHashSize square grayscale image: one bit per low
+// frequency coefficient, set if it is above the median.
+static uint64_t PHash(const std::vector<double>& g) {
+  const int n = kPHashSize;
+  const int k = kPHashLowFreq;
+
+  // Separable DCT-II, computing only the k x k lowest frequencies.
+  double c[k][n];
+  for (int u = 0; u < k; u++) {
+    for (int i = 0; i < n; i++) {
+      c[u][i] = cos((2 * i + 1) * u * M_PI / (2 * n));
+    }
+  }
+  double rows[n][k];
+  for (int y = 0; y < n; y++) {
+    for (int u = 0; u < k; u++) {
+      double sum = 0;
+      for (int i = 0; i < n; i++) {
+        sum += g[y * n + i] * c[u][i];
+      }
+      rows[y][u] = sum;
+    }
+  }
+  std::vector<double> dct(k * k);
+  for (int v = 0; v < k; v++) {
+    for (int u = 0; u < k; u++) {
+      double sum = 0;
+      for (int y = 0; y < n; y++) {
+        sum += rows[y][u] * c[v][y];
+      }
+      dct[v * k + u] = sum;
+    }
+  }
+
+  // Leave the DC term out of the median, it only reflects the overall
+  // brightness.
+  std::vector<double> ac(dct.begin() + 1, dct.end());
+  std::nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+  double median = ac[ac.size() / 2];
+
+  uint64_t hash = 0;
+  for (int i = 0; i < k * k; i++) {
+    hash = (hash << 1) | (dct[i] > median);
+  }
+  return hash;
+}
+
+// Compute a perceptual hash of type 'hash_type' for 'in'.  Scratch images
+// are local to 'in'.  Return 0 on success, non-zero on a vips error.
+static int HashImage(VipsImage* in, int hash_type, uint64_t* hash) {
+  bool cmyk = in->Type == IM_TYPE_CMYK && in->Bands >= 4;
+
+  int w, h;
+  switch (hash_type) {
+    case kHashDHash:  w = 9;           h = 8;           break;
+    case kHashPHash:  w = kPHashSize;  h = kPHashSize;  break;
+    default:
+      vips_error("HashImage", "unknown hash type %d", hash_type);
+      return -1;
+  }
+
+  VipsImage* t[3];
+  if (im_open_local_array(in, t, 3, "hash", "p")) {
+    return -1;
+  }
+  VipsImage* mem = im_open_local(in, "hash", "t");
+  if (mem == NULL) {
+    return -1;
+  }
+
+  // Box filter most of the way down, then resample to the exact size.
+  VipsImage* x = in;
+  int shrink = std::min(x->Xsize / (2 * w), x->Ysize / (2 * h));
+  if (shrink > 1) {
+    if (im_shrink(x, t[0], shrink, shrink)) {
+      return -1;
+    }
+    x = t[0];
+  }
+  if (im_resize_linear(x, t[1], w, h) ||
+      im_clip2fmt(t[1], t[2], IM_BANDFMT_DOUBLE) ||
+      im_copy(t[2], mem)) {
+    return -1;
+  }
+
+  // Take the luma of each pixel, ignoring any alpha band.  CMYK is
+  // converted to RGB naively first; the hash only needs relative brightness,
+  // not accurate colour.
+  std::vector<double> g(w * h);
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      const double* p =
+          reinterpret_cast<const double*>(VIPS_IMAGE_ADDR(mem, i, j));
+      double rgb[3];
+      if (cmyk) {
+        for (int b = 0; b < 3; b++) {
+          rgb[b] = (255 - p[b]) * (255 - p[3]) / 255;
+        }
+        p = rgb;
+      }
+      g[j * w + i] = mem->Bands >= 3 ?
+          0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2] : p[0];
+    }
+  }
+
+  *hash = hash_type == kHashDHash ? DHash(g) : PHash(g);
+  return 0;
+}
+
+// Compute a perceptual hash of type 'hash_type' for the image 'in', opened
+// from 'path' or from the 'len' bytes at 'buf' if it is non-NULL.  JPEGs
+// are reloaded with the largest shrink-on-load factor that leaves at least
+// twice the hash size, other images are hashed from 'in' directly.
+// DoTransform and PerceptualHash both hash through here, so a file gets
+// the same hash whatever it is resized to.  Images are local to 'in'.
+// Return 0 on success, non-zero on a vips error.
+static int HashSource(VipsImage* in, bool jpeg, const string& path,
+                      void* buf, size_t len, int hash_type, uint64_t* hash) {
+  int side;
+  switch (hash_type) {
+    case kHashDHash:  side = 9;           break;
+    case kHashPHash:  side = kPHashSize;  break;
+    default:
+      vips_error("HashSource", "unknown hash type %d", hash_type);
+      return -1;
+  }
+
+  VipsImage* x = in;
+  if (jpeg) {
+    int shrink = 8;
+    while (shrink > 1 && std::min(in->Xsize, in->Ysize) / shrink < 2 * side) {
+      shrink /= 2;
+    }
+    if (shrink > 1) {
+      x = LoadJpegUncached(path, buf, len, shrink);
+      if (x == NULL) {
+        return -1;
+      }
+      vips_object_local(in, x);
+    }
+  }
+  return HashImage(x, hash_type, hash);
+}
+
 // Resize the image, maintaining aspect ratio.  If 'crop' is true, the
 // image will be scaled down until one dimension reaches the box and
 // then the image will be cropped to reach the exact dimensions
@@ -210,6 +585,66 @@ static VipsImage* ResizeAndCrop(VipsImage* in, int new_x, int new_y,
   return x;
 }
 
+// Return the number of vips threads a job on an image of 'pixels' pixels
+// would like to have.
+static int WantedConcurrency(int64_t pixels) {
+  if (pixels <= kSmallImagePixels) {
+    return 1;
+  }
+  int64_t extra = pixels - kSmallImagePixels;
+  return 1 + static_cast<int>(
+      (extra + kPixelsPerThread - 1) / kPixelsPerThread);
+}
+
+// Set the vips thread count from the running transforms' demands: enough
+// for the largest image, but no more than the share of the cores each
+// running transform gets.  Transforms waiting for a thread pool worker
+// don't count, as they use no cores yet.  Must hold demands_lock.
+static void ApplyConcurrencyLocked() {
+  if (demands.empty() ||
+      g_atomic_int_get(&concurrency_setting) != kAutoConcurrency) {
+    return;
+  }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) cores = 1;
+  int share = std::max(1, static_cast<int>(cores / demands.size()));
+  vips_concurrency_set(std::min(*demands.rbegin(), share));
+}
+
+// Registers the threads wanted by a transform for as long as this object
+// is in scope.
+//
+// vips has a single process wide thread count, read as each pipeline
+// starts to evaluate, so there is no way to give one job its own setting.
+// Instead the setting follows the largest image being transformed, which
+// keeps a small job that starts later from leaving a large one with a
+// single thread.
+class ConcurrencyDemand {
+ public:
+  ConcurrencyDemand() : wanted_(0) {}
+
+  ~ConcurrencyDemand() {
+    if (wanted_ > 0) {
+      pthread_mutex_lock(&demands_lock);
+      demands.erase(demands.find(wanted_));
+      ApplyConcurrencyLocked();
+      pthread_mutex_unlock(&demands_lock);
+    }
+  }
+
+  void Add(int wanted) {
+    assert(wanted_ == 0 && wanted > 0);
+    wanted_ = wanted;
+    pthread_mutex_lock(&demands_lock);
+    demands.insert(wanted_);
+    ApplyConcurrencyLocked();
+    pthread_mutex_unlock(&demands_lock);
+  }
+
+ private:
+  int wanted_;
+};
+
 // Rotate the image, returning a new VipsImage that is allocated local
 // to 'in'.  Return NULL if there is an error.
 VipsImage* Rotate(VipsImage* in, int degrees) {
@@ -233,8 +668,15 @@ VipsImage* Rotate(VipsImage* in, int degrees) {
 int DoTransform(int cols, int rows, bool crop_to_size,
 		int rotate_degrees, bool auto_orient,
 		const string& src_path, const string& dst_path,
-                int* new_width, int* new_height, string* err_msg) {
+                int* new_width, int* new_height,
+                int hash_type, uint64_t* hash, string* err_msg) {
+  // Declared in this order so images are freed before the temp output is
+  // removed and the input is unmapped (if it was not handed to 'in').
+  ConcurrencyDemand concurrency;
+  MappedFile mapped;
+  TempOutput tmp_out;
   ImageFreer freer;
+  int io_flags = g_atomic_int_get(&io_mode);
 
   if (src_path == dst_path) {
     err_msg->assign("dest path cannot be same as source path");
@@ -259,9 +701,16 @@ int DoTransform(int cols, int rows, bool crop_to_size,
     return -1;
   }
 
+  // The mapping is only used to decode JPEGs and to read EXIF data.
+  if ((io_flags & kIOMmapInput) && (imgformat == "jpeg" || auto_orient) &&
+      mapped.Map(src_path, err_msg) < 0) {
+    return -1;
+  }
+
   // If auto-orienting, find how much we need to rotate.
   if (auto_orient) {
-    int r = GetEXIFRotationNeeded(src_path.c_str(), err_msg);
+    int r = GetEXIFRotationNeeded(src_path.c_str(), mapped.data(),
+                                  mapped.size(), err_msg);
     if (r < 0) {
       return -1;
     }
@@ -274,17 +723,34 @@ int DoTransform(int cols, int rows, bool crop_to_size,
     return -1;
   }
 
-  // Open the input and output images.
+  // Write to a temp file if the output is to be renamed into place.
+  string write_path = dst_path;
+  if (io_flags & kIOAtomicOutput) {
+    if (tmp_out.Create(dst_path, err_msg) < 0) {
+      return -1;
+    }
+    write_path = tmp_out.path();
+  }
+
+  // Open the input and output images.  Only the jpeg loader can read from
+  // memory, other formats are read from the path even when mapped.
   VipsImage *in, *out;
   {
-    in = vips_image_new_mode(src_path.c_str(), "rd");
+    if (mapped.data() != NULL && imgformat == "jpeg") {
+      in = LoadJpegUncached(src_path, mapped.data(), mapped.size(), 1);
+      if (in != NULL) {
+        mapped.UnmapWhenClosed(in);
+      }
+    } else {
+      in = vips_image_new_mode(src_path.c_str(), "rd");
+    }
     if (in == NULL) {
       SetFromVipsError(err_msg, "could not open input");
       return -1;
     }
     freer.add(in);
 
-    out = vips_image_new_mode(dst_path.c_str(), "w");
+    out = vips_image_new_mode(write_path.c_str(), "w");
     if (out == NULL) {
       SetFromVipsError(err_msg, "could not open output");
       return -1;
@@ -293,6 +759,17 @@ int DoTransform(int cols, int rows, bool crop_to_size,
     vips_object_local(in, out);
   }
 
+  concurrency.Add(
+      WantedConcurrency(static_cast<int64_t>(in->Xsize) * in->Ysize));
+
+  // Hash the source, before any resizing, cropping or rotation.
+  if (hash_type != kHashNone &&
+      HashSource(in, imgformat == "jpeg", src_path, mapped.data(),
+                 mapped.size(), hash_type, hash)) {
+    SetFromVipsError(err_msg, "hash failed");
+    return -1;
+  }
+
   // Resize and/or crop.
   VipsImage* img = in;
   if (cols > 0 && rows > 0) {
@@ -320,24 +797,116 @@ int DoTransform(int cols, int rows, bool crop_to_size,
 
   // Write new EXIF orientation.
   if (auto_orient && rotate_degrees > 0) {
-    if (WriteEXIFOrientation(dst_path, 1 /* orientation */) < 0) {
+    if (WriteEXIFOrientation(write_path, 1 /* orientation */) < 0) {
       err_msg->assign("failed to write new EXIF orientation");
       return -1;
     }
   }
 
+  if ((io_flags & kIOAtomicOutput) &&
+      tmp_out.Commit(io_flags & kIOFsyncOutput, err_msg) < 0) {
+    return -1;
+  }
+
   if (new_width != NULL) *new_width = img->Xsize;
   if (new_height != NULL) *new_height = img->Ysize;
 
   return 0;
 }
 
+int PerceptualHash(int hash_type, const string& src_path,
+                   const void* data, size_t len,
+                   uint64_t* hash, string* err_msg) {
+  ImageFreer freer;
+
+  if (hash_type != kHashDHash && hash_type != kHashPHash) {
+    err_msg->assign("unknown hash type");
+    return -1;
+  }
+
+  bool jpeg;
+  if (data != NULL) {
+    const unsigned char* b = static_cast<const unsigned char*>(data);
+    if (len < 2 || b[0] != 0xff || b[1] != 0xd8) {
+      err_msg->assign("only jpeg images can be hashed from memory");
+      return -1;
+    }
+    jpeg = true;
+  } else {
+    VipsFormatClass* format = vips_format_for_file(src_path.c_str());
+    if (format == NULL) {
+      SetFromVipsError(err_msg, "could not open file");
+      return -1;
+    }
+    jpeg = strcmp(VIPS_OBJECT_CLASS(format)->nickname, "jpeg") == 0;
+  }
+
+  // Opening only reads the header, HashSource decides what to decode.
+  VipsImage* in;
+  if (data != NULL) {
+    in = LoadJpegUncached(src_path, const_cast<void*>(data), len, 1);
+  } else {
+    in = vips_image_new_mode(src_path.c_str(), "rd");
+  }
+  if (in == NULL) {
+    SetFromVipsError(err_msg, "could not open input");
+    return -1;
+  }
+  freer.add(in);
+
+  if (HashSource(in, jpeg, src_path, const_cast<void*>(data), len,
+                 hash_type, hash)) {
+    SetFromVipsError(err_msg, "hash failed");
+    return -1;
+  }
+  return 0;
+}
+
 void InitTransform(const char* argv0) {
   assert(vips_init(argv0) == 0);
 
   // Need to initialize XmpParser before any threads.
   // TODO(walt): when we switch to a newer version of libexiv2, provide a mutex.
   Exiv2::XmpParser::initialize();
+
+  mode_t mask = umask(0);
+  umask(mask);
+  output_mode = 0666 & ~mask;
+
+  SetConcurrency(kAutoConcurrency);
+}
+
+int SetConcurrency(int threads) {
+  if (threads < 0) {
+    return -1;
+  }
+  // Hold the lock so a transform applying the automatic setting can't
+  // overwrite a fixed one.
+  pthread_mutex_lock(&demands_lock);
+  g_atomic_int_set(&concurrency_setting, threads);
+  if (threads > 0) {
+    vips_concurrency_set(threads);
+  } else {
+    ApplyConcurrencyLocked();
+  }
+  pthread_mutex_unlock(&demands_lock);
+  return 0;
+}
+
+int GetConcurrency() {
+  return vips_concurrency_get();
+}
+
+int SetCacheMax(int max_ops) {
+  if (max_ops < 0) {
+    return -1;
+  }
+  vips_cache_set_max(max_ops);
+  return 0;
+}
+
+void SetIOMode(int flags) {
+  g_atomic_int_set(&io_mode, flags);
 }
 
 int PNGPixel(unsigned char red, unsigned char green, unsigned char blue,
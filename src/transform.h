@@ -4,8 +4,17 @@
 #ifndef NODE_VIPS_TRANSFORM_H__
 #define NODE_VIPS_TRANSFORM_H__
 
+#include <stdint.h>
 #include <string>
 
+// Perceptual hash types.  kHashDHash compares the brightness of
+// neighbouring pixels in a 9x8 thumbnail; kHashPHash thresholds the low
+// frequencies of the DCT of a 32x32 thumbnail, which is slower but more
+// robust to contrast and gamma changes.
+const int kHashNone = 0;
+const int kHashDHash = 1;
+const int kHashPHash = 2;
+
 // Transform: resize and/or rotate an image.
 //
 // If 'cols' or 'rows' is < 0, no resizing is done.  Otherwise, the image is
@@ -21,15 +30,72 @@
 // image, and it is rotated to be right side up, and an orientation of '1'
 // is written back to the EXIF.
 //
+// If 'hash_type' is not kHashNone, a 64-bit perceptual hash of the source
+// image is stored in 'hash'.  It is computed before any resizing, cropping
+// or rotation, the same way as PerceptualHash, so it does not depend on
+// the other arguments and matches PerceptualHash for the same file.
+//
 // Return 0 on success, > 0 if an error and fill in 'err_msg'.
 int DoTransform(int cols, int rows, bool crop_to_size,
                 int rotate_degrees, bool auto_orient,
                 const std::string& src_path, const std::string& dst_path,
-                int* new_width, int* new_height, std::string* err_msg);
+                int* new_width, int* new_height,
+                int hash_type, uint64_t* hash, std::string* err_msg);
+
+// Compute a perceptual hash of type 'hash_type' for the image in
+// 'src_path', or for the 'len' bytes at 'data' if it is non-NULL.  JPEGs
+// are shrunk while loading; in-memory images must be JPEGs.
+// Return 0 on success, < 0 if an error and fill in 'err_msg'.
+int PerceptualHash(int hash_type, const std::string& src_path,
+                   const void* data, size_t len,
+                   uint64_t* hash, std::string* err_msg);
 
-// Must be called once before DoTransform.
+// Must be called once before DoTransform.  Starts in automatic
+// concurrency mode with the default vips operation cache size.
 void InitTransform(const char* argv0);
 
+// Pass to SetConcurrency to pick the number of vips threads
+// automatically.
+const int kAutoConcurrency = 0;
+
+// Set the number of threads vips uses to process an image.  vips only has
+// one process wide setting, so this is a hint shared by all transforms
+// rather than a per-job limit.  If 'threads' is kAutoConcurrency, the
+// setting is recomputed as transforms start and finish: enough threads
+// for the largest image being transformed (one for small images), but no
+// more than each running transform's share of the cores.
+//
+// This only splits the cores among the transforms that are running.  How
+// many run at once is up to the caller's thread pool (for the node module,
+// the libuv pool, sized by UV_THREADPOOL_SIZE), and is not adjusted here.
+//
+// Return 0 on success, < 0 if 'threads' is negative.
+int SetConcurrency(int threads);
+
+// Return the number of threads vips currently uses per image.
+int GetConcurrency();
+
+// Set the maximum number of operations vips keeps in its cache.
+// Return 0 on success, < 0 if 'max_ops' is negative.
+int SetCacheMax(int max_ops);
+
+// Flags for SetIOMode.
+//
+// kIOMmapInput: memory map the source and decode JPEGs straight from the
+// mapping instead of through buffered reads.
+// kIOAtomicOutput: write the output to a temporary file in the same
+// directory as 'dst_path' and rename it into place once it is complete,
+// so a failed transform never leaves a partial file at 'dst_path'.
+// kIOFsyncOutput: with kIOAtomicOutput, fsync the output and its directory
+// before and after the rename.
+const int kIOMmapInput = 1;
+const int kIOAtomicOutput = 2;
+const int kIOFsyncOutput = 4;
+
+// Set how DoTransform reads and writes files, a combination of the kIO
+// flags above.  The default of 0 reads and writes the paths directly.
+void SetIOMode(int flags);
+
 // Creates an in memory 1 pixel png with given rgba values (0-255)
 // Return 0 on success, > 0 if an error and fill in 'err_msg'.
 int PNGPixel(unsigned char red, unsigned char green, unsigned char blue,
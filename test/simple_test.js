@@ -82,6 +82,171 @@ module.exports = testCase({
   },
 
 
+  test_resize_fixed_concurrency: function(assert) {
+    vips.setConcurrency(3);
+    assert.equals(3, vips.transformStats().threads);
+    vips.resize(input1, nextOutput(), 170, 170, true, false, function(err, m){
+      var threads = vips.transformStats().threads;
+      vips.setConcurrency(0);
+      assert.ok(!err, "unexpected error: " + err);
+      assert.equals(170, m.width);
+      assert.equals(3, threads, "fixed concurrency was not respected");
+      assert.done();
+    });
+  },
+  test_resize_auto_concurrency_small_image: function(assert) {
+    // 225x300, well under the size that gets more than one thread.
+    vips.setConcurrency(0);
+    vips.resize("test/bogus_value_for_orientation_tag.jpg", nextOutput(),
+                100, 100, true, false, function(err, m) {
+      assert.ok(!err, "unexpected error: " + err);
+      assert.equals(1, vips.transformStats().threads);
+      assert.done();
+    });
+  },
+  test_set_concurrency_bad_arg: function(assert) {
+    assert.throws(function() { vips.setConcurrency("four"); });
+    assert.throws(function() { vips.setConcurrency(-1); });
+    assert.done();
+  },
+  test_resize_cache_max: function(assert) {
+    assert.throws(function() { vips.setCacheMax(-1); });
+    vips.setCacheMax(0);
+    vips.resize(input1, nextOutput(), 170, 170, true, false, function(err, m){
+      vips.setCacheMax(1000);  // the vips default
+      assert.ok(!err, "unexpected error: " + err);
+      assert.equals(170, m.width);
+      assert.done();
+    });
+  },
+  test_resize_mmap_atomic: function(assert) {
+    var output = nextOutput();
+    vips.setIOMode(true, true, true);
+    vips.resize(input1, output, 170, 170, true, true, function(err, m){
+      vips.setIOMode(false, false, false);
+      assert.ok(!err, "unexpected error: " + err);
+      assert.equals(170, m.width);
+      assert.ok(fs.existsSync(output), "output was not renamed into place");
+      assert.done();
+    });
+  },
+  // test/truncated.png has a valid header but is cut off half way through
+  // the image data, so decoding fails after the output has been opened.
+  test_resize_atomic_no_partial_output: function(assert) {
+    var output = nextOutput();
+    var tmpPrefix = '.' + output.replace('test/', '') + '.';
+    vips.setIOMode(false, true, false);
+    vips.resize("test/truncated.png", output, 100, 100, true, false,
+                function(err, metadata) {
+      vips.setIOMode(false, false, false);
+      assert.ok(err, "expected error but did not get one");
+      assert.ok(!fs.existsSync(output), "partial output left behind");
+      var tmps = fs.readdirSync('test').filter(function(name) {
+        return name.indexOf(tmpPrefix) == 0;
+      });
+      assert.equals(0, tmps.length, "temp output left behind: " + tmps);
+      assert.done();
+    });
+  },
+  test_resize_hash_independent_of_crop: function(assert) {
+    vips.resize(input1, nextOutput(), 170, 170, true, false, "dhash",
+                function(err, cropped) {
+      assert.ok(!err, "unexpected error: " + err);
+      assert.ok(/^[0-9a-f]{16}$/.test(cropped.hash), "bad hash " + cropped.hash);
+      vips.resize(input1, nextOutput(), 170, 170, false, false, "dhash",
+                  function(err, fitted) {
+        assert.ok(!err, "unexpected error: " + err);
+        assert.equals(cropped.hash, fitted.hash);
+        assert.done();
+      });
+    });
+  },
+  test_hash_path_and_buffer: function(assert) {
+    vips.hash(input2, function(err, fromPath) {
+      assert.ok(!err, "unexpected error: " + err);
+      vips.hash(fs.readFileSync(input2), function(err, fromBuffer) {
+        assert.ok(!err, "unexpected error: " + err);
+        assert.equals(fromPath, fromBuffer);
+        vips.hash(input2, "dhash", function(err, dhash) {
+          assert.ok(!err, "unexpected error: " + err);
+          assert.equals(fromPath, dhash, "dhash should be the default");
+          assert.done();
+        });
+      });
+    });
+  },
+  test_resize_hash_matches_hash: function(assert) {
+    vips.resize(input1, nextOutput(), 300, 200, true, true, "dhash",
+                function(err, m) {
+      assert.ok(!err, "unexpected error: " + err);
+      vips.hash(input1, "dhash", function(err, hash) {
+        assert.ok(!err, "unexpected error: " + err);
+        assert.equals(hash, m.hash);
+        assert.done();
+      });
+    });
+  },
+  test_phash: function(assert) {
+    vips.resize(input2, nextOutput(), 170, 170, true, false, "phash",
+                function(err, m) {
+      assert.ok(!err, "unexpected error: " + err);
+      assert.ok(/^[0-9a-f]{16}$/.test(m.hash), "bad hash " + m.hash);
+      vips.hash(input2, "phash", function(err, phash) {
+        assert.ok(!err, "unexpected error: " + err);
+        assert.equals(m.hash, phash);
+        vips.hash(input2, "dhash", function(err, dhash) {
+          assert.ok(!err, "unexpected error: " + err);
+          assert.ok(phash != dhash, "phash and dhash should differ");
+          assert.done();
+        });
+      });
+    });
+  },
+  test_hash_bad_type: function(assert) {
+    assert.throws(function() { vips.hash(input1, "md5", function() {}); });
+    assert.done();
+  },
+  test_resize_coalesced: function(assert) {
+    var output = nextOutput();
+    var results = [];
+    var before = vips.transformStats();
+    vips.setCoalesce(true);
+    for (var i = 0; i < 3; i++) {
+      vips.resize(input1, output, 170, 170, true, false, function(err, m) {
+        assert.ok(!err, "unexpected error: " + err);
+        results.push(m);
+        if (results.length == 3) {
+          vips.setCoalesce(false);
+          var after = vips.transformStats();
+          assert.equals(1, after.queued - before.queued);
+          assert.equals(2, after.coalesced - before.coalesced);
+          assert.equals(170, results[0].width);
+          assert.equals(170, results[2].height);
+          assert.done();
+        }
+      });
+    }
+  },
+  test_resize_coalesced_error: function(assert) {
+    var output = nextOutput();
+    var errors = 0;
+    var before = vips.transformStats();
+    vips.setCoalesce(true);
+    for (var i = 0; i < 2; i++) {
+      vips.resize("test/NOTFOUND", output, 100, 100, true, false,
+                  function(err, metadata) {
+        assert.ok(err, "expected error but did not get one");
+        if (++errors == 2) {
+          vips.setCoalesce(false);
+          var after = vips.transformStats();
+          assert.equals(1, after.queued - before.queued);
+          assert.equals(1, after.coalesced - before.coalesced);
+          assert.done();
+        }
+      });
+    }
+  },
+
   test_rotate_basic: function(assert) {
     var output = nextOutput();
     vips.rotate(input2, output, 90, function(err, metadata){